@@ -1,11 +1,25 @@
+#define _XOPEN_SOURCE 700
+#define _FILE_OFFSET_BITS 64
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
 
 #define BOOT_SIZE 512
 #define SUPER_SIZE 512
 #define N_DBLOCKS 10
 #define N_IBLOCKS 4
+#define OUTPUT_FILE_NAME "disk_defrag"
 
 struct superblock
 {
@@ -34,14 +48,177 @@ struct inode
     int i3block;            /* Pointer to triply indirect block */
 };
 
+// Layout must match the on-disk format regardless of optimization level
+_Static_assert(sizeof(struct superblock) == 24, "superblock must be 24 bytes");
+_Static_assert(sizeof(struct inode) == 100, "inode must be 100 bytes");
+
+#define INDEX_MAGIC 0x58494644 /* "DFIX" */
+#define INDEX_VERSION 1
+
+// Sidecar index: header, then files sorted by inode number, then extents
+struct index_header
+{
+    int magic;                      /* INDEX_MAGIC */
+    int version;                    /* INDEX_VERSION */
+    unsigned long long fingerprint; /* hash of superblock and inode region */
+    struct superblock super;        /* geometry the index was built for */
+    int n_files;                    /* number of live inodes */
+    int reserved;                   /* keeps the layout free of padding */
+    long long total_size;           /* image size in bytes */
+    long long n_extents;            /* total extents over all files */
+};
+
+struct index_file
+{
+    int inode_num;                 /* position in the inode region */
+    int blocks;                    /* data blocks in the file, holes included */
+    unsigned long long inode_hash; /* hash of the 100-byte inode */
+    long long first_extent;        /* first of this file's extents */
+    long long n_extents;           /* number of extents */
+};
+
+struct extent
+{
+    int start;  /* first data block of the run, -1 for a hole */
+    int length; /* number of blocks in the run */
+};
+
+_Static_assert(sizeof(struct index_header) == 64, "index header must be 64 bytes");
+_Static_assert(sizeof(struct index_file) == 32, "index file entry must be 32 bytes");
+
 // Global variables
 unsigned char *input_disk;
 unsigned char *output_disk;
 struct superblock super;
-long total_size;
-long inode_start;
-long data_start;
-long swap_start;
+long long total_size;
+long long inode_start;
+long long data_start;
+long long swap_start;
+int ptrs_per_block;
+int in_fd;
+int out_fd;
+
+// Sidecar index in use, NULL when running without one
+struct index_file *index_files;
+int n_index_files;
+struct extent *index_extents;
+long long n_index_extents;
+
+// Per-blocksize kernels, picked once from the superblock
+void (*copy_block)(unsigned char *dst, const unsigned char *src);
+void (*zero_block)(unsigned char *dst);
+void (*fill_unused_ptrs)(int *ptrs, int from);
+
+// Fixed-size variants let the compiler inline memcpy/memset and unroll the fill
+#define DEFINE_BLOCK_KERNELS(BS)                                  \
+    void copy_block_##BS(unsigned char *dst, const unsigned char *src) \
+    {                                                             \
+        memcpy(dst, src, BS);                                     \
+    }                                                             \
+    void zero_block_##BS(unsigned char *dst)                      \
+    {                                                             \
+        memset(dst, 0, BS);                                       \
+    }                                                             \
+    void fill_unused_ptrs_##BS(int *ptrs, int from)               \
+    {                                                             \
+        int k;                                                    \
+        for (k = from; k < (BS) / 4; k++)                         \
+        {                                                         \
+            ptrs[k] = -1;                                         \
+        }                                                         \
+    }
+
+DEFINE_BLOCK_KERNELS(512)
+DEFINE_BLOCK_KERNELS(1024)
+DEFINE_BLOCK_KERNELS(4096)
+
+// Generic fallback for any other block size
+void copy_block_generic(unsigned char *dst, const unsigned char *src)
+{
+    memcpy(dst, src, super.blocksize);
+}
+
+void zero_block_generic(unsigned char *dst)
+{
+    memset(dst, 0, super.blocksize);
+}
+
+void fill_unused_ptrs_generic(int *ptrs, int from)
+{
+    int k;
+    for (k = from; k < ptrs_per_block; k++)
+    {
+        ptrs[k] = -1;
+    }
+}
+
+// Helper function to pick block kernels for super.blocksize
+void select_block_kernels()
+{
+    ptrs_per_block = super.blocksize / 4;
+
+    switch (super.blocksize)
+    {
+    case 512:
+        copy_block = copy_block_512;
+        zero_block = zero_block_512;
+        fill_unused_ptrs = fill_unused_ptrs_512;
+        break;
+    case 1024:
+        copy_block = copy_block_1024;
+        zero_block = zero_block_1024;
+        fill_unused_ptrs = fill_unused_ptrs_1024;
+        break;
+    case 4096:
+        copy_block = copy_block_4096;
+        zero_block = zero_block_4096;
+        fill_unused_ptrs = fill_unused_ptrs_4096;
+        break;
+    default:
+        copy_block = copy_block_generic;
+        zero_block = zero_block_generic;
+        fill_unused_ptrs = fill_unused_ptrs_generic;
+        break;
+    }
+}
+
+// Helper function to get the byte offset of a data block
+long long block_offset(int block)
+{
+    return data_start + (long long)block * super.blocksize;
+}
+
+// Helper function to read exactly len bytes at offset
+int read_at(int fd, void *buf, size_t len, long long offset)
+{
+    unsigned char *p = (unsigned char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = pread(fd, p, len, offset);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// Helper function to write exactly len bytes at offset
+int write_at(int fd, const void *buf, size_t len, long long offset)
+{
+    const unsigned char *p = (const unsigned char *)buf;
+    while (len > 0)
+    {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
 
 // Helper function to calculate blocks needed
 int get_blocks_needed(int file_size)
@@ -68,12 +245,8 @@ int read_direct_blocks(struct inode *in_inode, unsigned char **file_data, int bl
         if (in_inode->dblocks[j] == -1)
             break;
 
-        long offset = data_start + in_inode->dblocks[j] * super.blocksize;
-        int k;
-        for (k = 0; k < super.blocksize; k++)
-        {
-            file_data[blocks_read][k] = input_disk[offset + k];
-        }
+        long long offset = block_offset(in_inode->dblocks[j]);
+        copy_block(file_data[blocks_read], input_disk + offset);
         blocks_read++;
     }
     return blocks_read;
@@ -82,7 +255,6 @@ int read_direct_blocks(struct inode *in_inode, unsigned char **file_data, int bl
 // Helper function to read single indirect blocks
 int read_single_indirect(struct inode *in_inode, unsigned char **file_data, int blocks_needed, int blocks_read)
 {
-    int ptrs_per_block = super.blocksize / 4;
     int j;
     for (j = 0; j < N_IBLOCKS; j++)
     {
@@ -91,7 +263,7 @@ int read_single_indirect(struct inode *in_inode, unsigned char **file_data, int
         if (in_inode->iblocks[j] == -1)
             break;
 
-        long indirect_offset = data_start + in_inode->iblocks[j] * super.blocksize;
+        long long indirect_offset = block_offset(in_inode->iblocks[j]);
         int *ptrs = (int *)(input_disk + indirect_offset);
 
         int p;
@@ -102,12 +274,8 @@ int read_single_indirect(struct inode *in_inode, unsigned char **file_data, int
             if (ptrs[p] == -1)
                 break;
 
-            long offset = data_start + ptrs[p] * super.blocksize;
-            int k;
-            for (k = 0; k < super.blocksize; k++)
-            {
-                file_data[blocks_read][k] = input_disk[offset + k];
-            }
+            long long offset = block_offset(ptrs[p]);
+            copy_block(file_data[blocks_read], input_disk + offset);
             blocks_read++;
         }
     }
@@ -120,8 +288,7 @@ int read_double_indirect(struct inode *in_inode, unsigned char **file_data, int
     if (in_inode->i2block == -1)
         return blocks_read;
 
-    int ptrs_per_block = super.blocksize / 4;
-    long i2_offset = data_start + in_inode->i2block * super.blocksize;
+    long long i2_offset = block_offset(in_inode->i2block);
     int *level1 = (int *)(input_disk + i2_offset);
 
     int j;
@@ -132,7 +299,7 @@ int read_double_indirect(struct inode *in_inode, unsigned char **file_data, int
         if (level1[j] == -1)
             break;
 
-        long indirect_offset = data_start + level1[j] * super.blocksize;
+        long long indirect_offset = block_offset(level1[j]);
         int *level2 = (int *)(input_disk + indirect_offset);
 
         int p;
@@ -143,12 +310,8 @@ int read_double_indirect(struct inode *in_inode, unsigned char **file_data, int
             if (level2[p] == -1)
                 break;
 
-            long offset = data_start + level2[p] * super.blocksize;
-            int k;
-            for (k = 0; k < super.blocksize; k++)
-            {
-                file_data[blocks_read][k] = input_disk[offset + k];
-            }
+            long long offset = block_offset(level2[p]);
+            copy_block(file_data[blocks_read], input_disk + offset);
             blocks_read++;
         }
     }
@@ -161,8 +324,7 @@ int read_triple_indirect(struct inode *in_inode, unsigned char **file_data, int
     if (in_inode->i3block == -1)
         return blocks_read;
 
-    int ptrs_per_block = super.blocksize / 4;
-    long i3_offset = data_start + in_inode->i3block * super.blocksize;
+    long long i3_offset = block_offset(in_inode->i3block);
     int *level1 = (int *)(input_disk + i3_offset);
 
     int j;
@@ -173,7 +335,7 @@ int read_triple_indirect(struct inode *in_inode, unsigned char **file_data, int
         if (level1[j] == -1)
             break;
 
-        long i2_offset = data_start + level1[j] * super.blocksize;
+        long long i2_offset = block_offset(level1[j]);
         int *level2 = (int *)(input_disk + i2_offset);
 
         int p;
@@ -184,7 +346,7 @@ int read_triple_indirect(struct inode *in_inode, unsigned char **file_data, int
             if (level2[p] == -1)
                 break;
 
-            long indirect_offset = data_start + level2[p] * super.blocksize;
+            long long indirect_offset = block_offset(level2[p]);
             int *level3 = (int *)(input_disk + indirect_offset);
 
             int q;
@@ -195,12 +357,8 @@ int read_triple_indirect(struct inode *in_inode, unsigned char **file_data, int
                 if (level3[q] == -1)
                     break;
 
-                long offset = data_start + level3[q] * super.blocksize;
-                int k;
-                for (k = 0; k < super.blocksize; k++)
-                {
-                    file_data[blocks_read][k] = input_disk[offset + k];
-                }
+                long long offset = block_offset(level3[q]);
+                copy_block(file_data[blocks_read], input_disk + offset);
                 blocks_read++;
             }
         }
@@ -218,12 +376,8 @@ int write_direct_blocks(unsigned char **file_data, struct inode *out_inode, int
         if (blocks_written >= blocks_needed)
             break;
 
-        long offset = data_start + next_block * super.blocksize;
-        int k;
-        for (k = 0; k < super.blocksize; k++)
-        {
-            output_disk[offset + k] = file_data[blocks_written][k];
-        }
+        long long offset = block_offset(next_block);
+        copy_block(output_disk + offset, file_data[blocks_written]);
 
         out_inode->dblocks[j] = next_block;
         next_block++;
@@ -243,7 +397,6 @@ int write_direct_blocks(unsigned char **file_data, struct inode *out_inode, int
 int write_single_indirect(unsigned char **file_data, struct inode *out_inode, int blocks_needed, int blocks_written, int *next_block_ptr)
 {
     int next_block = *next_block_ptr;
-    int ptrs_per_block = super.blocksize / 4;
     int indirect_used = 0;
 
     int j;
@@ -256,17 +409,14 @@ int write_single_indirect(unsigned char **file_data, struct inode *out_inode, in
         int iblock_num = next_block;
         next_block++;
 
-        long iblock_offset = data_start + iblock_num * super.blocksize;
+        long long iblock_offset = block_offset(iblock_num);
         int *iblock_ptrs = (int *)(output_disk + iblock_offset);
 
-        int k;
-        for (k = 0; k < super.blocksize; k++)
-        {
-            output_disk[iblock_offset + k] = 0;
-        }
+        zero_block(output_disk + iblock_offset);
 
         // Write data blocks
         int ptr_count = 0;
+        int k;
         for (k = 0; k < ptrs_per_block; k++)
         {
             if (blocks_written >= blocks_needed)
@@ -277,22 +427,15 @@ int write_single_indirect(unsigned char **file_data, struct inode *out_inode, in
 
             iblock_ptrs[k] = data_block_num;
 
-            long offset = data_start + data_block_num * super.blocksize;
-            int m;
-            for (m = 0; m < super.blocksize; m++)
-            {
-                output_disk[offset + m] = file_data[blocks_written][m];
-            }
+            long long offset = block_offset(data_block_num);
+            copy_block(output_disk + offset, file_data[blocks_written]);
 
             blocks_written++;
             ptr_count++;
         }
 
         // Set remaining pointers to -1
-        for (k = ptr_count; k < ptrs_per_block; k++)
-        {
-            iblock_ptrs[k] = -1;
-        }
+        fill_unused_ptrs(iblock_ptrs, ptr_count);
 
         out_inode->iblocks[j] = iblock_num;
         indirect_used++;
@@ -318,19 +461,15 @@ int write_double_indirect(unsigned char **file_data, struct inode *out_inode, in
     }
 
     int next_block = *next_block_ptr;
-    int ptrs_per_block = super.blocksize / 4;
 
     int i2block_num = next_block;
     next_block++;
 
-    long i2block_offset = data_start + i2block_num * super.blocksize;
+    long long i2block_offset = block_offset(i2block_num);
     int *i2block_ptrs = (int *)(output_disk + i2block_offset);
 
     //
-    for (int k = 0; k < super.blocksize; k++)
-    {
-        output_disk[i2block_offset + k] = 0;
-    }
+    zero_block(output_disk + i2block_offset);
 
     int i2_count = 0;
     while (blocks_written < blocks_needed && i2_count < ptrs_per_block)
@@ -342,13 +481,10 @@ int write_double_indirect(unsigned char **file_data, struct inode *out_inode, in
         i2block_ptrs[i2_count] = iblock_num;
         i2_count++;
 
-        long iblock_offset = data_start + iblock_num * super.blocksize;
+        long long iblock_offset = block_offset(iblock_num);
         int *iblock_ptrs = (int *)(output_disk + iblock_offset);
 
-        for (int k = 0; k < super.blocksize; k++)
-        {
-            output_disk[iblock_offset + k] = 0;
-        }
+        zero_block(output_disk + iblock_offset);
 
         // Write data blocks
         int ptr_count = 0;
@@ -362,29 +498,19 @@ int write_double_indirect(unsigned char **file_data, struct inode *out_inode, in
 
             iblock_ptrs[k] = data_block_num;
 
-            long offset = data_start + data_block_num * super.blocksize;
-            int m;
-            for (m = 0; m < super.blocksize; m++)
-            {
-                output_disk[offset + m] = file_data[blocks_written][m];
-            }
+            long long offset = block_offset(data_block_num);
+            copy_block(output_disk + offset, file_data[blocks_written]);
 
             blocks_written++;
             ptr_count++;
         }
 
         // Set remaining pointers to -1
-        for (int k = ptr_count; k < ptrs_per_block; k++)
-        {
-            iblock_ptrs[k] = -1;
-        }
+        fill_unused_ptrs(iblock_ptrs, ptr_count);
     }
 
     // Set remaining i2 pointers to -1
-    for (int k = i2_count; k < ptrs_per_block; k++)
-    {
-        i2block_ptrs[k] = -1;
-    }
+    fill_unused_ptrs(i2block_ptrs, i2_count);
 
     out_inode->i2block = i2block_num;
     *next_block_ptr = next_block;
@@ -401,18 +527,14 @@ int write_triple_indirect(unsigned char **file_data, struct inode *out_inode, in
     }
 
     int next_block = *next_block_ptr;
-    int ptrs_per_block = super.blocksize / 4;
 
     int i3block_num = next_block;
     next_block++;
 
-    long i3block_offset = data_start + i3block_num * super.blocksize;
+    long long i3block_offset = block_offset(i3block_num);
     int *i3block_ptrs = (int *)(output_disk + i3block_offset);
 
-    for (int k = 0; k < super.blocksize; k++)
-    {
-        output_disk[i3block_offset + k] = 0;
-    }
+    zero_block(output_disk + i3block_offset);
 
     int i3_count = 0;
     while (blocks_written < blocks_needed && i3_count < ptrs_per_block)
@@ -424,14 +546,11 @@ int write_triple_indirect(unsigned char **file_data, struct inode *out_inode, in
         i3block_ptrs[i3_count] = i2block_num;
         i3_count++;
 
-        long i2block_offset = data_start + i2block_num * super.blocksize;
+        long long i2block_offset = block_offset(i2block_num);
         int *i2block_ptrs = (int *)(output_disk + i2block_offset);
 
         //
-        for (int k = 0; k < super.blocksize; k++)
-        {
-            output_disk[i2block_offset + k] = 0;
-        }
+        zero_block(output_disk + i2block_offset);
 
         int i2_count = 0;
         while (blocks_written < blocks_needed && i2_count < ptrs_per_block)
@@ -443,14 +562,11 @@ int write_triple_indirect(unsigned char **file_data, struct inode *out_inode, in
             i2block_ptrs[i2_count] = iblock_num;
             i2_count++;
 
-            long iblock_offset = data_start + iblock_num * super.blocksize;
+            long long iblock_offset = block_offset(iblock_num);
             int *iblock_ptrs = (int *)(output_disk + iblock_offset);
 
             //
-            for (int k = 0; k < super.blocksize; k++)
-            {
-                output_disk[iblock_offset + k] = 0;
-            }
+            zero_block(output_disk + iblock_offset);
 
             // Write data blocks
             int ptr_count = 0;
@@ -464,36 +580,23 @@ int write_triple_indirect(unsigned char **file_data, struct inode *out_inode, in
 
                 iblock_ptrs[k] = data_block_num;
 
-                long offset = data_start + data_block_num * super.blocksize;
-                int m;
-                for (m = 0; m < super.blocksize; m++)
-                {
-                    output_disk[offset + m] = file_data[blocks_written][m];
-                }
+                long long offset = block_offset(data_block_num);
+                copy_block(output_disk + offset, file_data[blocks_written]);
 
                 blocks_written++;
                 ptr_count++;
             }
 
             // Set remaining pointers to -1
-            for (int k = ptr_count; k < ptrs_per_block; k++)
-            {
-                iblock_ptrs[k] = -1;
-            }
+            fill_unused_ptrs(iblock_ptrs, ptr_count);
         }
 
         // Set remaining i2 pointers to -1
-        for (int k = i2_count; k < ptrs_per_block; k++)
-        {
-            i2block_ptrs[k] = -1;
-        }
+        fill_unused_ptrs(i2block_ptrs, i2_count);
     }
 
     // Set remaining i3 pointers to -1
-    for (int k = i3_count; k < ptrs_per_block; k++)
-    {
-        i3block_ptrs[k] = -1;
-    }
+    fill_unused_ptrs(i3block_ptrs, i3_count);
 
     out_inode->i3block = i3block_num;
     *next_block_ptr = next_block;
@@ -510,16 +613,12 @@ void process_file(struct inode *in_inode, struct inode *out_inode, int *next_blo
     int blocks_needed = get_blocks_needed(file_size);
 
     // Allocate array for file data
-    unsigned char **file_data = (unsigned char **)malloc(blocks_needed * sizeof(unsigned char *));
+    unsigned char **file_data = (unsigned char **)malloc((size_t)blocks_needed * sizeof(unsigned char *));
     int b;
     for (b = 0; b < blocks_needed; b++)
     {
         file_data[b] = (unsigned char *)malloc(super.blocksize);
-        int k;
-        for (k = 0; k < super.blocksize; k++)
-        {
-            file_data[b][k] = 0;
-        }
+        zero_block(file_data[b]);
     }
 
     // Read all blocks from input
@@ -553,50 +652,29 @@ void process_file(struct inode *in_inode, struct inode *out_inode, int *next_blo
 // Function to copy boot, super, and swap regions
 void copy_static_regions()
 {
-    int i;
-
-    // Copy boot block
-    for (i = 0; i < BOOT_SIZE; i++)
-    {
-        output_disk[i] = input_disk[i];
-    }
-
-    // Copy superblock
-    for (i = BOOT_SIZE; i < BOOT_SIZE + SUPER_SIZE; i++)
-    {
-        output_disk[i] = input_disk[i];
-    }
+    // Copy boot block and superblock
+    memcpy(output_disk, input_disk, BOOT_SIZE + SUPER_SIZE);
 
     // Copy inode region
-    long inode_end = data_start;
-    long inode_size = inode_end - inode_start;
-    for (i = 0; i < inode_size; i++)
-    {
-        output_disk[inode_start + i] = input_disk[inode_start + i];
-    }
+    long long inode_end = data_start;
+    long long inode_size = inode_end - inode_start;
+    memcpy(output_disk + inode_start, input_disk + inode_start, inode_size);
 
     // Copy swap region
-    long swap_size = total_size - swap_start;
-    for (i = 0; i < swap_size; i++)
-    {
-        output_disk[swap_start + i] = input_disk[swap_start + i];
-    }
+    long long swap_size = total_size - swap_start;
+    memcpy(output_disk + swap_start, input_disk + swap_start, swap_size);
 }
 
 // Function to create free block list
 void create_free_list(int next_block)
 {
-    long total_blocks = (swap_start - data_start) / super.blocksize;
+    long long total_blocks = (swap_start - data_start) / super.blocksize;
     int i;
     for (i = next_block; i < total_blocks; i++)
     {
-        long offset = data_start + i * super.blocksize;
+        long long offset = block_offset(i);
 
-        int k;
-        for (k = 0; k < super.blocksize; k++)
-        {
-            output_disk[offset + k] = 0;
-        }
+        zero_block(output_disk + offset);
 
         // Set next pointer
         int *next_ptr = (int *)(output_disk + offset);
@@ -611,125 +689,1640 @@ void create_free_list(int next_block)
     }
 }
 
-int main(int argc, char *argv[])
+// ---------------------------------------------------------------------------
+// Block tree walking: lists a file's source data blocks in file order,
+// reading indirect blocks from memory or, without a loaded image, from disk.
+// ---------------------------------------------------------------------------
+
+int *walk_ptrs[4]; /* indirect blocks read from disk, per level */
+
+// Helper function to get an in-range indirect block of the input, NULL on a read error
+int *read_ptr_block(int level, int block)
 {
-    // Check arguments
-    if (argc < 2)
+    if (input_disk != NULL)
+        return (int *)(input_disk + block_offset(block));
+
+    if (walk_ptrs[level] == NULL)
+        walk_ptrs[level] = (int *)malloc(super.blocksize);
+    if (walk_ptrs[level] == NULL || read_at(in_fd, walk_ptrs[level], super.blocksize, block_offset(block)) < 0)
+        return NULL;
+    return walk_ptrs[level];
+}
+
+// Helper function to list the source blocks under an indirect block
+int walk_indirect(int level, int block, int *remaining, int (*emit)(int block))
+{
+    // An unreadable subtree contributes no blocks; walk_file pads the file with holes
+    if (block < 0 || block_offset(block) + super.blocksize > total_size)
+        return 0;
+
+    int *ptrs = read_ptr_block(level, block);
+    if (ptrs == NULL)
+        return -1;
+
+    int p;
+    for (p = 0; p < ptrs_per_block; p++)
     {
-        printf("Error: Need filename\n");
-        return 1;
+        if (*remaining == 0)
+            break;
+        if (ptrs[p] == -1)
+            break;
+
+        if (level == 1)
+        {
+            if (emit(ptrs[p]) < 0)
+                return -1;
+            (*remaining)--;
+        }
+        else if (walk_indirect(level - 1, ptrs[p], remaining, emit) < 0)
+        {
+            return -1;
+        }
     }
+    return 0;
+}
 
-    // Check struct sizes
-    if (sizeof(struct superblock) != 24)
+// Function to list a file's source blocks, padding with -1 for missing blocks
+int walk_file(struct inode *in_inode, int blocks_needed, int (*emit)(int block))
+{
+    int remaining = blocks_needed;
+
+    int j;
+    for (j = 0; j < N_DBLOCKS; j++)
     {
-        printf("Superblock size wrong: %d\n", (int)sizeof(struct superblock));
-        return 1;
+        if (remaining == 0)
+            break;
+        if (in_inode->dblocks[j] == -1)
+            break;
+        if (emit(in_inode->dblocks[j]) < 0)
+            return -1;
+        remaining--;
     }
-    if (sizeof(struct inode) != 100)
+
+    for (j = 0; j < N_IBLOCKS; j++)
     {
-        printf("Inode size wrong: %d\n", (int)sizeof(struct inode));
-        return 1;
+        if (remaining == 0)
+            break;
+        if (in_inode->iblocks[j] == -1)
+            break;
+        if (walk_indirect(1, in_inode->iblocks[j], &remaining, emit) < 0)
+            return -1;
     }
 
-    // Open input file
-    FILE *f = fopen(argv[1], "rb");
-    if (f == NULL)
+    if (remaining > 0 && in_inode->i2block != -1)
     {
-        printf("Cannot open file\n");
-        return 1;
+        if (walk_indirect(2, in_inode->i2block, &remaining, emit) < 0)
+            return -1;
+    }
+    if (remaining > 0 && in_inode->i3block != -1)
+    {
+        if (walk_indirect(3, in_inode->i3block, &remaining, emit) < 0)
+            return -1;
     }
 
-    // Get file size
-    fseek(f, 0, SEEK_END);
-    total_size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-
-    // Allocate memory
-    input_disk = (unsigned char *)malloc(total_size);
-    output_disk = (unsigned char *)malloc(total_size);
+    // Blocks missing from the tree stay zero, like in the in-memory path
+    while (remaining > 0)
+    {
+        if (emit(-1) < 0)
+            return -1;
+        remaining--;
+    }
+    return 0;
+}
 
-    // Read file
-    int bytes = fread(input_disk, 1, total_size, f);
-    if (bytes != total_size)
+// ---------------------------------------------------------------------------
+// Sidecar index: the live inodes and their run-length extent lists, keyed by
+// a fingerprint of the superblock and inode region. A matching index is used
+// straight from its mapping; otherwise only inodes whose bytes changed are
+// walked again and the index is rewritten. The key does not cover indirect
+// blocks, so the index only feeds analysis; defragmenting always walks trees.
+// ---------------------------------------------------------------------------
+
+void *index_map;
+size_t index_map_size;
+int index_reused;    /* files taken from the previous index */
+int index_rescanned; /* files whose trees were walked */
+
+// Index being built
+struct index_file *build_files;
+int build_n_files;
+int build_files_cap;
+struct extent *build_extents;
+long long build_n_extents;
+long long build_extents_cap;
+
+// Helper function to hash bytes with 64-bit FNV-1a
+unsigned long long fnv1a(unsigned long long hash, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    size_t k;
+    for (k = 0; k < len; k++)
     {
-        printf("Read error\n");
-        return 1;
+        hash ^= p[k];
+        hash *= 0x100000001b3ULL;
     }
-    fclose(f);
+    return hash;
+}
 
-    // Clear output
-    int i;
-    for (i = 0; i < total_size; i++)
+// Helper function to fingerprint the superblock and inode region
+unsigned long long image_fingerprint(const unsigned char *inodes)
+{
+    unsigned long long hash = 0xcbf29ce484222325ULL;
+    hash = fnv1a(hash, &super, sizeof(struct superblock));
+    hash = fnv1a(hash, &total_size, sizeof(total_size));
+    return fnv1a(hash, inodes, data_start - inode_start);
+}
+
+// Helper function to find a file entry by inode number
+struct index_file *find_index_file(struct index_file *files, int n_files, int inode_num)
+{
+    int lo = 0;
+    int hi = n_files - 1;
+    while (lo <= hi)
     {
-        output_disk[i] = 0;
+        int mid = lo + (hi - lo) / 2;
+        if (files[mid].inode_num == inode_num)
+            return &files[mid];
+        if (files[mid].inode_num < inode_num)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
     }
+    return NULL;
+}
 
-    // Read superblock
-    struct superblock *sb_ptr = (struct superblock *)&input_disk[BOOT_SIZE];
-    super.blocksize = sb_ptr->blocksize;
-    super.inode_offset = sb_ptr->inode_offset;
-    super.data_offset = sb_ptr->data_offset;
-    super.swap_offset = sb_ptr->swap_offset;
-    super.free_inode = sb_ptr->free_inode;
-    super.free_block = sb_ptr->free_block;
+// Helper function to make room for extra extents in the index being built
+int reserve_extents(long long extra)
+{
+    if (build_n_extents + extra <= build_extents_cap)
+        return 0;
 
-    // Calculate regions
-    inode_start = BOOT_SIZE + SUPER_SIZE + super.inode_offset * super.blocksize;
-    data_start = BOOT_SIZE + SUPER_SIZE + super.data_offset * super.blocksize;
-    swap_start = BOOT_SIZE + SUPER_SIZE + ((long long)super.swap_offset) * super.blocksize;
+    long long cap = build_extents_cap ? build_extents_cap : 1024;
+    while (cap < build_n_extents + extra)
+        cap *= 2;
+    struct extent *grown = (struct extent *)realloc(build_extents, cap * sizeof(struct extent));
+    if (grown == NULL)
+        return -1;
+    build_extents = grown;
+    build_extents_cap = cap;
+    return 0;
+}
 
-    // Fix swap_start if needed
-    if (swap_start > total_size || swap_start < 0)
+// Helper function to add a block to the last file's extents, merging runs
+int append_extent_block(int block)
+{
+    struct index_file *file = &build_files[build_n_files - 1];
+    if (file->n_extents > 0)
     {
-        swap_start = total_size;
+        struct extent *last = &build_extents[build_n_extents - 1];
+        if ((block == -1 && last->start == -1) || (block != -1 && last->start != -1 && block == last->start + last->length))
+        {
+            last->length++;
+            return 0;
+        }
     }
 
-    // Copy static regions
-    copy_static_regions();
+    if (reserve_extents(1) < 0)
+        return -1;
+    build_extents[build_n_extents].start = block;
+    build_extents[build_n_extents].length = 1;
+    build_n_extents++;
+    file->n_extents++;
+    return 0;
+}
 
-    // Process each inode
-    long inode_size = data_start - inode_start;
-    int total_inodes = inode_size / 100;
-    int next_block = 0;
+// Helper function to check a mapped index and point at its arrays
+int check_index(const unsigned char *map, size_t size, struct index_file **files, struct extent **extents)
+{
+    const struct index_header *h = (const struct index_header *)map;
+    if (size < sizeof(struct index_header) || h->magic != INDEX_MAGIC || h->version != INDEX_VERSION)
+        return -1;
+    // Bound the counts by the file size first so the products cannot wrap
+    size_t body = size - sizeof(struct index_header);
+    if (h->n_files < 0 || h->n_extents < 0 || (size_t)h->n_files > body / sizeof(struct index_file) ||
+        (unsigned long long)h->n_extents > body / sizeof(struct extent) ||
+        body != (size_t)h->n_files * sizeof(struct index_file) + (size_t)h->n_extents * sizeof(struct extent))
+        return -1;
+
+    *files = (struct index_file *)(map + sizeof(struct index_header));
+    *extents = (struct extent *)(map + sizeof(struct index_header) + (size_t)h->n_files * sizeof(struct index_file));
+
+    int f;
+    for (f = 0; f < h->n_files; f++)
+    {
+        struct index_file *file = &(*files)[f];
+        if (f > 0 && file->inode_num <= (*files)[f - 1].inode_num)
+            return -1;
+        if (file->blocks < 0 || file->first_extent < 0 || file->n_extents < 0 ||
+            file->first_extent > h->n_extents || file->n_extents > h->n_extents - file->first_extent)
+            return -1;
+
+        // Extents must be holes or real blocks and cover exactly the file
+        long long blocks = 0;
+        long long e;
+        for (e = 0; e < file->n_extents; e++)
+        {
+            struct extent *ext = &(*extents)[file->first_extent + e];
+            if (ext->start < -1 || ext->length <= 0 || (ext->start >= 0 && ext->length > INT_MAX - ext->start))
+                return -1;
+            blocks += ext->length;
+        }
+        if (blocks != file->blocks)
+            return -1;
+    }
+    return 0;
+}
 
-    int inode_num;
+// Function to rebuild the index, reusing entries of unchanged inodes
+int build_index(const unsigned char *inodes, struct index_file *old_files, int old_n_files,
+                struct extent *old_extents)
+{
+    long long total_inodes = (data_start - inode_start) / 100;
+    long long inode_num;
     for (inode_num = 0; inode_num < total_inodes; inode_num++)
     {
-        struct inode *in_inode = (struct inode *)(input_disk + inode_start + inode_num * 100);
-        struct inode *out_inode = (struct inode *)(output_disk + inode_start + inode_num * 100);
+        struct inode in_inode;
+        memcpy(&in_inode, inodes + inode_num * 100, sizeof(struct inode));
+        if (in_inode.nlink == 0)
+            continue;
 
-        if (in_inode->nlink == 0)
+        if (build_n_files == build_files_cap)
+        {
+            int cap = build_files_cap ? 2 * build_files_cap : 256;
+            struct index_file *grown = (struct index_file *)realloc(build_files, cap * sizeof(struct index_file));
+            if (grown == NULL)
+                return -1;
+            build_files = grown;
+            build_files_cap = cap;
+        }
+
+        struct index_file *file = &build_files[build_n_files++];
+        file->inode_num = (int)inode_num;
+        file->blocks = get_blocks_needed(in_inode.size);
+        file->inode_hash = fnv1a(0xcbf29ce484222325ULL, &in_inode, sizeof(struct inode));
+        file->first_extent = build_n_extents;
+        file->n_extents = 0;
+
+        // Unchanged inode: copy its extents from the previous index as is
+        struct index_file *old = find_index_file(old_files, old_n_files, (int)inode_num);
+        if (old != NULL && old->inode_hash == file->inode_hash && old->blocks == file->blocks)
+        {
+            if (reserve_extents(old->n_extents) < 0)
+                return -1;
+            memcpy(build_extents + build_n_extents, old_extents + old->first_extent,
+                   old->n_extents * sizeof(struct extent));
+            build_n_extents += old->n_extents;
+            file->n_extents = old->n_extents;
+            index_reused++;
             continue;
+        }
 
-        process_file(in_inode, out_inode, &next_block);
+        if (walk_file(&in_inode, file->blocks, append_extent_block) < 0)
+            return -1;
+        index_rescanned++;
     }
+    return 0;
+}
 
-    // Update superblock
-    struct superblock *out_sb = (struct superblock *)(output_disk + BOOT_SIZE);
-    out_sb->free_block = next_block;
+// Helper function to write the built index atomically
+int save_index(const char *path, unsigned long long fingerprint)
+{
+    struct index_header h;
+    memset(&h, 0, sizeof(h));
+    h.magic = INDEX_MAGIC;
+    h.version = INDEX_VERSION;
+    h.fingerprint = fingerprint;
+    h.super = super;
+    h.n_files = build_n_files;
+    h.total_size = total_size;
+    h.n_extents = build_n_extents;
+
+    size_t len = strlen(path);
+    char *tmp_path = (char *)malloc(len + 5);
+    if (tmp_path == NULL)
+        return -1;
+    memcpy(tmp_path, path, len);
+    memcpy(tmp_path + len, ".tmp", 5);
+
+    FILE *out = fopen(tmp_path, "wb");
+    int rc = -1;
+    if (out != NULL)
+    {
+        if (fwrite(&h, sizeof(h), 1, out) == 1 &&
+            fwrite(build_files, sizeof(struct index_file), build_n_files, out) == (size_t)build_n_files &&
+            fwrite(build_extents, sizeof(struct extent), build_n_extents, out) == (size_t)build_n_extents)
+            rc = 0;
+        if (fclose(out) != 0)
+            rc = -1;
+        if (rc == 0 && rename(tmp_path, path) != 0)
+            rc = -1;
+        if (rc != 0)
+            remove(tmp_path);
+    }
+    free(tmp_path);
+    return rc;
+}
 
-    // Create free block list
-    create_free_list(next_block);
+// Function to load the index at path (may be NULL), refreshing it if stale
+int load_index(const char *path, const unsigned char *inodes)
+{
+    unsigned long long fingerprint = image_fingerprint(inodes);
+    struct index_file *old_files = NULL;
+    struct extent *old_extents = NULL;
+    int old_n_files = 0;
+
+    // Map the existing index, if any
+    int fd = path != NULL ? open(path, O_RDONLY) : -1;
+    if (fd >= 0)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(struct index_header))
+        {
+            void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED)
+            {
+                index_map = map;
+                index_map_size = st.st_size;
+            }
+        }
+        close(fd);
+    }
 
-    // Write output file
-    FILE *out = fopen("disk_defrag", "wb");
-    if (out == NULL)
+    if (index_map != NULL)
     {
-        printf("Cannot create output file\n");
-        return 1;
+        const struct index_header *h = (const struct index_header *)index_map;
+        struct index_file *files;
+        struct extent *extents;
+        if (check_index((const unsigned char *)index_map, index_map_size, &files, &extents) == 0)
+        {
+            // Same image: use the mapping as is
+            if (h->fingerprint == fingerprint && h->total_size == total_size &&
+                memcmp(&h->super, &super, sizeof(struct superblock)) == 0)
+            {
+                index_files = files;
+                n_index_files = h->n_files;
+                index_extents = extents;
+                n_index_extents = h->n_extents;
+                index_reused = h->n_files;
+                return 0;
+            }
+
+            // Same geometry: entries of unchanged inodes can be reused
+            if (h->super.blocksize == super.blocksize && h->super.inode_offset == super.inode_offset &&
+                h->super.data_offset == super.data_offset)
+            {
+                old_files = files;
+                old_n_files = h->n_files;
+                old_extents = extents;
+            }
+        }
     }
 
-    int written = fwrite(output_disk, 1, total_size, out);
-    if (written != total_size)
+    int rc = build_index(inodes, old_files, old_n_files, old_extents);
+
+    if (index_map != NULL)
     {
-        printf("Write error\n");
-        return 1;
+        munmap(index_map, index_map_size);
+        index_map = NULL;
     }
+    if (rc < 0)
+        return -1;
 
-    fclose(out);
-    free(input_disk);
-    free(output_disk);
+    index_files = build_files;
+    n_index_files = build_n_files;
+    index_extents = build_extents;
+    n_index_extents = build_n_extents;
 
+    if (path != NULL && save_index(path, fingerprint) < 0)
+        return -1;
     return 0;
-}
\ No newline at end of file
+}
+
+// Function to release the index
+void close_index()
+{
+    if (index_map != NULL)
+        munmap(index_map, index_map_size);
+    free(build_files);
+    free(build_extents);
+    index_map = NULL;
+    index_files = NULL;
+    index_extents = NULL;
+}
+
+// Helper function to read the inode region from disk
+unsigned char *read_inode_region()
+{
+    unsigned char *inodes = (unsigned char *)malloc(data_start - inode_start + 1);
+    if (inodes != NULL && read_at(in_fd, inodes, data_start - inode_start, inode_start) < 0)
+    {
+        free(inodes);
+        return NULL;
+    }
+    return inodes;
+}
+
+// Function to print a fragmentation report from the index
+void print_analysis()
+{
+    long long data_blocks = 0;
+    long long holes = 0;
+    int fragmented = 0;
+
+    int f;
+    for (f = 0; f < n_index_files; f++)
+    {
+        struct index_file *file = &index_files[f];
+        data_blocks += file->blocks;
+
+        // Gaps of up to 3 blocks are where a defragmented file keeps its
+        // indirect blocks; anything else means a seek
+        long long prev_end = -1;
+        int seeks = 0;
+        long long e;
+        for (e = 0; e < file->n_extents; e++)
+        {
+            struct extent *ext = &index_extents[file->first_extent + e];
+            if (ext->start == -1)
+            {
+                holes += ext->length;
+                continue;
+            }
+            if (prev_end != -1 && (ext->start < prev_end || ext->start > prev_end + 3))
+                seeks++;
+            prev_end = (long long)ext->start + ext->length;
+        }
+        if (seeks > 0)
+            fragmented++;
+    }
+
+    printf("Files: %d\n", n_index_files);
+    printf("Data blocks: %lld (%lld missing)\n", data_blocks, holes);
+    printf("Extents: %lld\n", n_index_extents);
+    printf("Fragmented files: %d (%.1f%%)\n", fragmented,
+           n_index_files ? 100.0 * fragmented / n_index_files : 0.0);
+    printf("Index: %d reused, %d rescanned\n", index_reused, index_rescanned);
+}
+
+// ---------------------------------------------------------------------------
+// Pre-flight consistency check: threads claim every block reachable from the
+// live inodes in a shared ownership bitmap, then the free list is walked and
+// its blocks checked for non-zero tails. Anything claimed twice, pointing
+// outside the data region, or owned by nobody is reported.
+// ---------------------------------------------------------------------------
+
+#define CHECK_MAX_THREADS 16
+#define CHECK_INODE_CHUNK 16 /* inodes a thread takes at a time */
+#define CHECK_MAX_MESSAGES 10
+
+struct check_stats
+{
+    long long double_owned; /* blocks claimed more than once */
+    long long out_of_range; /* pointers outside the data region */
+    long long missing;      /* files with fewer blocks than their size */
+    long long dirty_free;   /* free blocks with data after the next pointer */
+};
+
+const unsigned char *check_image; /* input image, loaded or mapped */
+long long check_blocks;           /* blocks in the data region */
+atomic_ulong *owned;              /* one bit per data block */
+atomic_llong next_check_inode;
+atomic_int messages_left;
+int *free_chain;                  /* free list in list order */
+long long free_chain_len;
+
+struct free_scan
+{
+    long long first; /* first free list slot this thread scans */
+    int stride;      /* slots between scanned blocks */
+    long long dirty; /* dirty blocks found */
+};
+
+// Helper function to print a problem, up to CHECK_MAX_MESSAGES of them
+void check_message(const char *fmt, ...)
+{
+    if (atomic_fetch_sub(&messages_left, 1) <= 0)
+        return;
+
+    // Format first so lines from different threads are printed whole
+    char line[256];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(line, sizeof(line), fmt, args);
+    va_end(args);
+    printf("Check: %s\n", line);
+}
+
+// Helper function to claim a data block, returning -1 if it cannot be used
+int claim_block(int block, int inode_num, struct check_stats *stats)
+{
+    if (block < 0 || block >= check_blocks)
+    {
+        stats->out_of_range++;
+        check_message("inode %d points outside the data region: %d", inode_num, block);
+        return -1;
+    }
+
+    unsigned long mask = 1UL << (block % (8 * sizeof(unsigned long)));
+    unsigned long old = atomic_fetch_or(&owned[block / (8 * sizeof(unsigned long))], mask);
+    if (old & mask)
+    {
+        stats->double_owned++;
+        check_message("block %d owned twice (inode %d)", block, inode_num);
+    }
+    return 0;
+}
+
+// Helper function to claim an indirect block and everything under it
+void check_indirect(int level, int block, int inode_num, int *remaining, struct check_stats *stats)
+{
+    if (claim_block(block, inode_num, stats) < 0)
+        return;
+
+    const int *ptrs = (const int *)(check_image + block_offset(block));
+    int p;
+    for (p = 0; p < ptrs_per_block; p++)
+    {
+        if (*remaining == 0)
+            break;
+        if (ptrs[p] == -1)
+            break;
+
+        if (level == 1)
+        {
+            claim_block(ptrs[p], inode_num, stats);
+            (*remaining)--;
+        }
+        else
+        {
+            check_indirect(level - 1, ptrs[p], inode_num, remaining, stats);
+        }
+    }
+}
+
+// Helper function to claim all blocks of one file
+void check_file(const struct inode *in_inode, int inode_num, struct check_stats *stats)
+{
+    if (in_inode->size == 0)
+        return;
+
+    int remaining = get_blocks_needed(in_inode->size);
+
+    int j;
+    for (j = 0; j < N_DBLOCKS; j++)
+    {
+        if (remaining == 0)
+            break;
+        if (in_inode->dblocks[j] == -1)
+            break;
+        claim_block(in_inode->dblocks[j], inode_num, stats);
+        remaining--;
+    }
+
+    for (j = 0; j < N_IBLOCKS; j++)
+    {
+        if (remaining == 0)
+            break;
+        if (in_inode->iblocks[j] == -1)
+            break;
+        check_indirect(1, in_inode->iblocks[j], inode_num, &remaining, stats);
+    }
+
+    if (remaining > 0 && in_inode->i2block != -1)
+        check_indirect(2, in_inode->i2block, inode_num, &remaining, stats);
+    if (remaining > 0 && in_inode->i3block != -1)
+        check_indirect(3, in_inode->i3block, inode_num, &remaining, stats);
+
+    if (remaining > 0)
+    {
+        stats->missing++;
+        check_message("inode %d is missing %d blocks", inode_num, remaining);
+    }
+}
+
+// Thread function to claim the blocks of live inodes, a chunk at a time
+void *check_inodes_thread(void *arg)
+{
+    struct check_stats *stats = (struct check_stats *)arg;
+    long long total_inodes = (data_start - inode_start) / 100;
+
+    while (1)
+    {
+        long long first = atomic_fetch_add(&next_check_inode, CHECK_INODE_CHUNK);
+        if (first >= total_inodes)
+            break;
+
+        long long last = first + CHECK_INODE_CHUNK;
+        if (last > total_inodes)
+            last = total_inodes;
+
+        long long inode_num;
+        for (inode_num = first; inode_num < last; inode_num++)
+        {
+            struct inode in_inode;
+            memcpy(&in_inode, check_image + inode_start + inode_num * 100, sizeof(struct inode));
+            if (in_inode.nlink != 0)
+                check_file(&in_inode, (int)inode_num, stats);
+        }
+    }
+    return NULL;
+}
+
+// Helper function to test bytes for zero, eight words per step
+int is_zero(const unsigned char *p, size_t len)
+{
+    size_t k = 0;
+    for (; k + 64 <= len; k += 64)
+    {
+        unsigned long long w[8];
+        memcpy(w, p + k, sizeof(w));
+        if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0)
+            return 0;
+    }
+    for (; k < len; k++)
+    {
+        if (p[k] != 0)
+            return 0;
+    }
+    return 1;
+}
+
+// Thread function to scan a slice of the free list for non-zero tails
+void *check_free_thread(void *arg)
+{
+    struct free_scan *scan = (struct free_scan *)arg;
+    long long k;
+    for (k = scan->first; k < free_chain_len; k += scan->stride)
+    {
+        int block = free_chain[k];
+        if (!is_zero(check_image + block_offset(block) + 4, super.blocksize - 4))
+            scan->dirty++;
+    }
+    return NULL;
+}
+
+// Helper function to walk the free list, claiming its blocks in order
+int walk_free_chain(struct check_stats *stats)
+{
+    const size_t bits = 8 * sizeof(unsigned long);
+    free_chain = (int *)malloc((check_blocks + 1) * sizeof(int));
+    unsigned long *on_list = (unsigned long *)calloc(check_blocks / bits + 1, sizeof(unsigned long));
+    if (free_chain == NULL || on_list == NULL)
+    {
+        free(on_list);
+        return -1;
+    }
+
+    int block = super.free_block;
+    while (block != -1)
+    {
+        if (block < 0 || block >= check_blocks)
+        {
+            stats->out_of_range++;
+            check_message("free list points outside the data region: %d", block);
+            break;
+        }
+
+        // Reaching a block already on the list again means the list loops
+        unsigned long mask = 1UL << (block % bits);
+        if (on_list[block / bits] & mask)
+        {
+            stats->double_owned++;
+            check_message("free list loops back to block %d", block);
+            break;
+        }
+        on_list[block / bits] |= mask;
+
+        // A block also used by a file is reported, then the walk goes on
+        unsigned long old = atomic_fetch_or(&owned[block / bits], mask);
+        if (old & mask)
+        {
+            stats->double_owned++;
+            check_message("free block %d is already owned", block);
+        }
+        else
+        {
+            free_chain[free_chain_len++] = block;
+        }
+        memcpy(&block, check_image + block_offset(block), sizeof(int));
+    }
+
+    free(on_list);
+    return 0;
+}
+
+// Helper function to count data blocks owned by nobody
+long long count_leaked()
+{
+    const size_t bits = 8 * sizeof(unsigned long);
+    long long leaked = 0;
+    long long w;
+    for (w = 0; w * (long long)bits < check_blocks; w++)
+    {
+        unsigned long used = atomic_load(&owned[w]);
+        long long valid = check_blocks - w * (long long)bits;
+        if (valid < (long long)bits)
+            used |= ~0UL << valid;
+        if (~used != 0)
+        {
+            if (leaked == 0)
+                check_message("block %lld is neither in use nor free", w * (long long)bits + __builtin_ctzl(~used));
+            leaked += __builtin_popcountl(~used);
+        }
+    }
+    return leaked;
+}
+
+// Function to check the input image before defragmenting, 0 if consistent
+int preflight_check()
+{
+    int rc = -1;
+    void *map = NULL;
+    atomic_store(&messages_left, CHECK_MAX_MESSAGES);
+
+    // Validate the region layout before anything is read through it
+    if (super.blocksize < 4 || super.inode_offset < 0 || super.data_offset < 0 || super.swap_offset < 0 ||
+        inode_start > data_start || data_start > swap_start || swap_start > total_size)
+    {
+        check_message("superblock geometry is invalid (blocksize %d, inode %d, data %d, swap %d offsets)",
+                      super.blocksize, super.inode_offset, super.data_offset, super.swap_offset);
+        return -1;
+    }
+
+    // Use the loaded image, otherwise map the input read-only
+    check_image = input_disk;
+    if (check_image == NULL)
+    {
+        map = mmap(NULL, total_size, PROT_READ, MAP_SHARED, in_fd, 0);
+        if (map == MAP_FAILED)
+        {
+            printf("Check: cannot map image\n");
+            return -1;
+        }
+        check_image = (const unsigned char *)map;
+    }
+
+    check_blocks = (swap_start - data_start) / super.blocksize;
+    size_t words = check_blocks / (8 * sizeof(unsigned long)) + 1;
+    owned = (atomic_ulong *)calloc(words, sizeof(atomic_ulong));
+    if (owned == NULL)
+    {
+        printf("Out of memory\n");
+        goto cleanup;
+    }
+
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    int n_threads = online < 1 ? 1 : (online > CHECK_MAX_THREADS ? CHECK_MAX_THREADS : (int)online);
+    pthread_t threads[CHECK_MAX_THREADS];
+    struct check_stats thread_stats[CHECK_MAX_THREADS];
+    struct check_stats stats;
+    memset(thread_stats, 0, sizeof(thread_stats));
+    memset(&stats, 0, sizeof(stats));
+    atomic_store(&next_check_inode, 0);
+
+    // Claim blocks of all live inodes in parallel
+    int t;
+    int started = 0;
+    for (t = 0; t < n_threads; t++)
+    {
+        if (pthread_create(&threads[t], NULL, check_inodes_thread, &thread_stats[t]) != 0)
+            break;
+        started++;
+    }
+    if (started == 0)
+        check_inodes_thread(&thread_stats[0]);
+    for (t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+    for (t = 0; t < n_threads; t++)
+    {
+        stats.double_owned += thread_stats[t].double_owned;
+        stats.out_of_range += thread_stats[t].out_of_range;
+        stats.missing += thread_stats[t].missing;
+    }
+
+    // The free list is a chain, so it is followed on one thread
+    if (walk_free_chain(&stats) < 0)
+    {
+        printf("Out of memory\n");
+        goto cleanup;
+    }
+
+    // Scan free block tails in parallel, each thread taking every n-th block
+    struct free_scan scans[CHECK_MAX_THREADS];
+    for (t = 0; t < n_threads; t++)
+    {
+        scans[t].first = t;
+        scans[t].stride = n_threads;
+        scans[t].dirty = 0;
+    }
+    started = 0;
+    for (t = 0; t < n_threads; t++)
+    {
+        if (pthread_create(&threads[t], NULL, check_free_thread, &scans[t]) != 0)
+            break;
+        started++;
+    }
+    for (t = started; t < n_threads; t++)
+        check_free_thread(&scans[t]);
+    for (t = 0; t < started; t++)
+        pthread_join(threads[t], NULL);
+    for (t = 0; t < n_threads; t++)
+        stats.dirty_free += scans[t].dirty;
+    if (stats.dirty_free > 0)
+        check_message("%lld free blocks not zero after the next pointer", stats.dirty_free);
+
+    long long leaked = count_leaked();
+    long long errors = stats.double_owned + stats.out_of_range + stats.missing + stats.dirty_free + leaked;
+    if (errors > 0)
+    {
+        printf("Check: %lld problems (%lld owned twice, %lld out of range, %lld leaked, %lld dirty free, "
+               "%lld short files)\n",
+               errors, stats.double_owned, stats.out_of_range, leaked, stats.dirty_free, stats.missing);
+        goto cleanup;
+    }
+    rc = 0;
+
+cleanup:
+    free(owned);
+    free(free_chain);
+    owned = NULL;
+    free_chain = NULL;
+    free_chain_len = 0;
+    if (map != NULL)
+        munmap(map, total_size);
+    check_image = NULL;
+    return rc;
+}
+
+// ---------------------------------------------------------------------------
+// Out-of-core mode: used when the image does not fit in the memory budget.
+// Each file's source blocks are spilled to a temporary list, the resulting
+// (old, new) block moves are written as sorted runs, and the runs are merged
+// so the input data region can be read once, front to back, in bounded
+// windows.
+// ---------------------------------------------------------------------------
+
+// Both can be overridden at build time to exercise the run merging on small
+// images, e.g. make CPPFLAGS="-DRUN_CAPACITY=16 -DMAX_RUNS=4"
+#ifndef MAX_RUNS
+#define MAX_RUNS 256 /* merge early once this many runs are open */
+#endif
+#ifndef RUN_CAPACITY
+#define RUN_CAPACITY 0 /* moves per run; 0 derives it from the budget */
+#endif
+
+struct block_move
+{
+    int old_block; /* source block in the input, -1 for a hole */
+    int new_block; /* destination block in the output */
+};
+
+struct merge_head
+{
+    struct block_move move; /* smallest unread move of this run */
+    FILE *run;              /* sorted run on disk */
+};
+
+unsigned char *window;      /* staging buffer for input/output windows */
+long long window_bytes;
+FILE *block_list;           /* source blocks of the current file, in file order */
+struct block_move *run_buf; /* moves not yet spilled */
+long run_count;
+long run_capacity;
+FILE **runs;
+int n_runs;
+int *out_ptrs[4];           /* indirect blocks built for output, per level */
+
+// Helper function to copy a byte range from input to output through the window
+int copy_range(long long start, long long len)
+{
+    while (len > 0)
+    {
+        long long chunk = len < window_bytes ? len : window_bytes;
+        if (read_at(in_fd, window, chunk, start) < 0)
+            return -1;
+        if (write_at(out_fd, window, chunk, start) < 0)
+            return -1;
+        start += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+// Helper function to append one source block to the current file's list
+int spill_block(int block)
+{
+    fwrite(&block, sizeof(int), 1, block_list);
+    return 0;
+}
+
+// Helper function to spill a file's source blocks in file order
+int collect_file(struct inode *in_inode, int blocks_needed)
+{
+    rewind(block_list);
+    if (walk_file(in_inode, blocks_needed, spill_block) < 0)
+        return -1;
+
+    if (fflush(block_list) != 0 || ferror(block_list))
+        return -1;
+    rewind(block_list);
+    return 0;
+}
+
+// Helper function to order moves by source block
+int compare_moves(const void *a, const void *b)
+{
+    const struct block_move *x = (const struct block_move *)a;
+    const struct block_move *y = (const struct block_move *)b;
+    if (x->old_block != y->old_block)
+        return x->old_block < y->old_block ? -1 : 1;
+    if (x->new_block != y->new_block)
+        return x->new_block < y->new_block ? -1 : 1;
+    return 0;
+}
+
+int consolidate_runs();
+
+// Helper function to sort the pending moves and spill them as one run
+int spill_run()
+{
+    if (run_count == 0)
+        return 0;
+
+    qsort(run_buf, run_count, sizeof(struct block_move), compare_moves);
+
+    FILE *run = tmpfile();
+    if (run == NULL)
+        return -1;
+    if (fwrite(run_buf, sizeof(struct block_move), run_count, run) != (size_t)run_count || fflush(run) != 0)
+    {
+        fclose(run);
+        return -1;
+    }
+    rewind(run);
+
+    FILE **grown = (FILE **)realloc(runs, (n_runs + 1) * sizeof(FILE *));
+    if (grown == NULL)
+    {
+        fclose(run);
+        return -1;
+    }
+    runs = grown;
+    runs[n_runs++] = run;
+    run_count = 0;
+
+    if (n_runs == MAX_RUNS)
+        return consolidate_runs();
+    return 0;
+}
+
+// Helper function to plan the next source block of the file into new_block
+int plan_data_block(int new_block)
+{
+    struct block_move move;
+    if (fread(&move.old_block, sizeof(int), 1, block_list) != 1)
+        return -1;
+    move.new_block = new_block;
+
+    if (run_count == run_capacity && spill_run() < 0)
+        return -1;
+    run_buf[run_count++] = move;
+    return 0;
+}
+
+// Helper function to lay out an indirect block and everything under it,
+// storing its block number in *block_ptr
+int plan_indirect(int level, int *next_block_ptr, int *remaining, int *block_ptr)
+{
+    int *ptrs = out_ptrs[level];
+    int self = *next_block_ptr;
+    (*next_block_ptr)++;
+
+    int count = 0;
+    while (*remaining > 0 && count < ptrs_per_block)
+    {
+        if (level == 1)
+        {
+            ptrs[count] = *next_block_ptr;
+            (*next_block_ptr)++;
+            if (plan_data_block(ptrs[count]) < 0)
+                return -1;
+            (*remaining)--;
+        }
+        else
+        {
+            if (plan_indirect(level - 1, next_block_ptr, remaining, &ptrs[count]) < 0)
+                return -1;
+        }
+        count++;
+    }
+
+    fill_unused_ptrs(ptrs, count);
+    if (write_at(out_fd, ptrs, super.blocksize, block_offset(self)) < 0)
+        return -1;
+    *block_ptr = self;
+    return 0;
+}
+
+// Function to plan one file's new layout and write its indirect blocks
+int plan_file(struct inode *inode, int *next_block_ptr)
+{
+    int file_size = inode->size;
+    if (file_size == 0)
+        return 0;
+
+    int blocks_needed = get_blocks_needed(file_size);
+    if (collect_file(inode, blocks_needed) < 0)
+        return -1;
+
+    int remaining = blocks_needed;
+    int next_block = *next_block_ptr;
+
+    int j;
+    for (j = 0; j < N_DBLOCKS; j++)
+    {
+        if (remaining == 0)
+        {
+            inode->dblocks[j] = -1;
+            continue;
+        }
+        inode->dblocks[j] = next_block;
+        if (plan_data_block(next_block) < 0)
+            return -1;
+        next_block++;
+        remaining--;
+    }
+
+    for (j = 0; j < N_IBLOCKS; j++)
+    {
+        inode->iblocks[j] = -1;
+        if (remaining > 0 && plan_indirect(1, &next_block, &remaining, &inode->iblocks[j]) < 0)
+            return -1;
+    }
+
+    inode->i2block = -1;
+    if (remaining > 0 && plan_indirect(2, &next_block, &remaining, &inode->i2block) < 0)
+        return -1;
+    inode->i3block = -1;
+    if (remaining > 0 && plan_indirect(3, &next_block, &remaining, &inode->i3block) < 0)
+        return -1;
+
+    *next_block_ptr = next_block;
+    return 0;
+}
+
+// Helper function to restore heap order below slot i
+void sift_down(struct merge_head *heap, int n, int i)
+{
+    while (1)
+    {
+        int smallest = i;
+        int l = 2 * i + 1;
+        int r = l + 1;
+        if (l < n && compare_moves(&heap[l].move, &heap[smallest].move) < 0)
+            smallest = l;
+        if (r < n && compare_moves(&heap[r].move, &heap[smallest].move) < 0)
+            smallest = r;
+        if (smallest == i)
+            return;
+        struct merge_head tmp = heap[i];
+        heap[i] = heap[smallest];
+        heap[smallest] = tmp;
+        i = smallest;
+    }
+}
+
+// Helper function to load the first move of every run into a heap,
+// returning the heap size or -1 on a read error
+int merge_start(struct merge_head *heap)
+{
+    int n = 0;
+    int r;
+    for (r = 0; r < n_runs; r++)
+    {
+        heap[n].run = runs[r];
+        if (fread(&heap[n].move, sizeof(struct block_move), 1, runs[r]) == 1)
+            n++;
+        else if (ferror(runs[r]))
+            return -1;
+    }
+    for (r = n / 2 - 1; r >= 0; r--)
+        sift_down(heap, n, r);
+    return n;
+}
+
+// Helper function to pop the smallest move across all runs into *move
+int merge_next(struct merge_head *heap, int *n, struct block_move *move)
+{
+    *move = heap[0].move;
+    if (fread(&heap[0].move, sizeof(struct block_move), 1, heap[0].run) != 1)
+    {
+        // A short read must be the end of the run, not an I/O error
+        if (ferror(heap[0].run))
+            return -1;
+        heap[0] = heap[--(*n)];
+    }
+    sift_down(heap, *n, 0);
+    return 0;
+}
+
+// Helper function to merge all runs into one so open runs stay bounded
+int consolidate_runs()
+{
+    struct merge_head *heap = (struct merge_head *)malloc(n_runs * sizeof(struct merge_head));
+    FILE *merged = tmpfile();
+    if (heap == NULL || merged == NULL)
+    {
+        free(heap);
+        if (merged != NULL)
+            fclose(merged);
+        return -1;
+    }
+
+    int n = merge_start(heap);
+    while (n > 0)
+    {
+        struct block_move move;
+        if (merge_next(heap, &n, &move) < 0)
+            break;
+        fwrite(&move, sizeof(struct block_move), 1, merged);
+    }
+    free(heap);
+
+    // Leave the runs for the caller to close if they could not be read
+    if (n != 0)
+    {
+        fclose(merged);
+        return -1;
+    }
+
+    int r;
+    for (r = 0; r < n_runs; r++)
+        fclose(runs[r]);
+    if (fflush(merged) != 0 || ferror(merged))
+    {
+        n_runs = 0;
+        fclose(merged);
+        return -1;
+    }
+    rewind(merged);
+    runs[0] = merged;
+    n_runs = 1;
+    return 0;
+}
+
+// Function to merge the runs and copy data blocks one input window at a time
+int copy_planned_blocks()
+{
+    long long window_blocks = window_bytes / super.blocksize;
+    long long win_first = 0;
+    long long win_count = 0;
+
+    // Pending extent of moves that are contiguous in both input and output
+    long long ext_old = 0;
+    long long ext_new = 0;
+    long long ext_len = 0;
+
+    struct merge_head *heap = (struct merge_head *)malloc((n_runs + 1) * sizeof(struct merge_head));
+    if (heap == NULL)
+        return -1;
+
+    int n = merge_start(heap);
+    int rc = n < 0 ? -1 : 0;
+    while (n > 0 && rc == 0)
+    {
+        struct block_move move;
+        if (merge_next(heap, &n, &move) < 0)
+        {
+            rc = -1;
+            break;
+        }
+
+        // Holes and out-of-image pointers leave the output block zeroed
+        if (move.old_block < 0 || block_offset(move.old_block) + super.blocksize > total_size)
+            continue;
+
+        if (ext_len > 0 && move.old_block == ext_old + ext_len && move.new_block == ext_new + ext_len &&
+            move.old_block < win_first + win_count)
+        {
+            ext_len++;
+            continue;
+        }
+
+        // Flush the pending extent before moving on
+        if (ext_len > 0)
+        {
+            if (write_at(out_fd, window + (ext_old - win_first) * super.blocksize, ext_len * super.blocksize,
+                         block_offset(ext_new)) < 0)
+                rc = -1;
+            ext_len = 0;
+        }
+
+        // Slide the window forward to this block
+        if (rc == 0 && (move.old_block < win_first || move.old_block >= win_first + win_count))
+        {
+            win_first = move.old_block;
+            win_count = (total_size - block_offset(move.old_block)) / super.blocksize;
+            if (win_count > window_blocks)
+                win_count = window_blocks;
+            if (read_at(in_fd, window, win_count * super.blocksize, block_offset(win_first)) < 0)
+                rc = -1;
+        }
+
+        ext_old = move.old_block;
+        ext_new = move.new_block;
+        ext_len = 1;
+    }
+
+    if (rc == 0 && ext_len > 0)
+    {
+        if (write_at(out_fd, window + (ext_old - win_first) * super.blocksize, ext_len * super.blocksize,
+                     block_offset(ext_new)) < 0)
+            rc = -1;
+    }
+
+    free(heap);
+    return rc;
+}
+
+// Function to write the sorted free block list one window at a time
+int write_free_list(int next_block)
+{
+    long long window_blocks = window_bytes / super.blocksize;
+    long long total_blocks = (swap_start - data_start) / super.blocksize;
+    long long i = next_block;
+
+    while (i < total_blocks)
+    {
+        long long count = total_blocks - i;
+        if (count > window_blocks)
+            count = window_blocks;
+
+        memset(window, 0, count * super.blocksize);
+        long long b;
+        for (b = 0; b < count; b++)
+        {
+            int next = (i + b + 1 < total_blocks) ? (int)(i + b + 1) : -1;
+            memcpy(window + b * super.blocksize, &next, sizeof(int));
+        }
+
+        if (write_at(out_fd, window, count * super.blocksize, block_offset(i)) < 0)
+            return -1;
+        i += count;
+    }
+    return 0;
+}
+
+// Function to defragment without holding the image in memory
+int defrag_out_of_core(long long mem_limit)
+{
+    int rc = 1;
+    int level;
+
+    // Split the budget between the I/O window and the move buffer
+    window_bytes = (mem_limit / 4) / super.blocksize * super.blocksize;
+    if (window_bytes < super.blocksize)
+        window_bytes = super.blocksize;
+    if (window_bytes < (long long)sizeof(struct inode))
+        window_bytes = sizeof(struct inode);
+    run_capacity = (mem_limit / 4) / sizeof(struct block_move);
+    if (run_capacity < 1024)
+        run_capacity = 1024;
+    if (RUN_CAPACITY > 0)
+        run_capacity = RUN_CAPACITY;
+
+    FILE *out = fopen(OUTPUT_FILE_NAME, "wb+");
+    if (out == NULL)
+    {
+        printf("Cannot create output file\n");
+        return 1;
+    }
+    out_fd = fileno(out);
+
+    window = (unsigned char *)malloc(window_bytes);
+    run_buf = (struct block_move *)malloc(run_capacity * sizeof(struct block_move));
+    block_list = tmpfile();
+    for (level = 1; level <= 3; level++)
+    {
+        out_ptrs[level] = (int *)calloc(1, super.blocksize);
+    }
+    if (window == NULL || run_buf == NULL || block_list == NULL || out_ptrs[1] == NULL || out_ptrs[2] == NULL ||
+        out_ptrs[3] == NULL)
+    {
+        printf("Out of memory\n");
+        goto cleanup;
+    }
+
+    // Unwritten ranges read back as zeros
+    if (ftruncate(out_fd, total_size) != 0)
+    {
+        printf("Write error\n");
+        goto cleanup;
+    }
+
+    // Copy boot block, superblock, inode region and swap region
+    if (copy_range(0, BOOT_SIZE + SUPER_SIZE) < 0 || copy_range(inode_start, data_start - inode_start) < 0 ||
+        copy_range(swap_start, total_size - swap_start) < 0)
+    {
+        printf("Read error\n");
+        goto cleanup;
+    }
+
+    // Plan each inode, reading the inode region a window at a time
+    long long total_inodes = (data_start - inode_start) / 100;
+    long long chunk_inodes = window_bytes / 100;
+    int next_block = 0;
+
+    long long first;
+    for (first = 0; first < total_inodes; first += chunk_inodes)
+    {
+        long long count = total_inodes - first;
+        if (count > chunk_inodes)
+            count = chunk_inodes;
+        if (read_at(in_fd, window, count * 100, inode_start + first * 100) < 0)
+        {
+            printf("Read error\n");
+            goto cleanup;
+        }
+
+        long long k;
+        for (k = 0; k < count; k++)
+        {
+            struct inode inode;
+            memcpy(&inode, window + k * 100, sizeof(struct inode));
+            if (inode.nlink == 0)
+                continue;
+
+            if (plan_file(&inode, &next_block) < 0 ||
+                write_at(out_fd, &inode, sizeof(struct inode), inode_start + (first + k) * 100) < 0)
+            {
+                printf("Planning error\n");
+                goto cleanup;
+            }
+        }
+    }
+
+    if (spill_run() < 0)
+    {
+        printf("Planning error\n");
+        goto cleanup;
+    }
+
+    // Copy file data in source order
+    if (copy_planned_blocks() < 0)
+    {
+        printf("Copy error\n");
+        goto cleanup;
+    }
+
+    // Update superblock and create free block list
+    if (write_at(out_fd, &next_block, sizeof(int), BOOT_SIZE + offsetof(struct superblock, free_block)) < 0 ||
+        write_free_list(next_block) < 0)
+    {
+        printf("Write error\n");
+        goto cleanup;
+    }
+
+    rc = 0;
+
+cleanup:
+    if (fclose(out) != 0 && rc == 0)
+    {
+        printf("Write error\n");
+        rc = 1;
+    }
+    // Do not leave a half-written image behind
+    if (rc != 0)
+        remove(OUTPUT_FILE_NAME);
+    int r;
+    for (r = 0; r < n_runs; r++)
+        fclose(runs[r]);
+    free(runs);
+    if (block_list != NULL)
+        fclose(block_list);
+    for (level = 1; level <= 3; level++)
+    {
+        free(out_ptrs[level]);
+    }
+    free(run_buf);
+    free(window);
+    return rc;
+}
+
+// Helper function to get the default memory budget (half of physical memory)
+long long default_mem_limit()
+{
+    long pages = sysconf(_SC_PHYS_PAGES);
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || page_size <= 0)
+        return 1LL << 30;
+    return (long long)pages * page_size / 2;
+}
+
+int main(int argc, char *argv[])
+{
+    // Check arguments
+    long long mem_limit = default_mem_limit();
+    const char *index_path = NULL;
+    int analyze_only = 0;
+    int check_first = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "m:i:ac")) != -1)
+    {
+        if (opt == 'm' && atoll(optarg) > 0)
+        {
+            mem_limit = atoll(optarg) * 1024 * 1024;
+        }
+        else if (opt == 'i')
+        {
+            index_path = optarg;
+        }
+        else if (opt == 'a')
+        {
+            analyze_only = 1;
+        }
+        else if (opt == 'c')
+        {
+            check_first = 1;
+        }
+        else
+        {
+            printf("Usage: %s [-m megabytes] [-i index_file] [-a] [-c] <disk_image>\n", argv[0]);
+            return 1;
+        }
+    }
+    if (optind >= argc)
+    {
+        printf("Error: Need filename\n");
+        return 1;
+    }
+
+    // Check struct sizes
+    if (sizeof(struct superblock) != 24)
+    {
+        printf("Superblock size wrong: %d\n", (int)sizeof(struct superblock));
+        return 1;
+    }
+    if (sizeof(struct inode) != 100)
+    {
+        printf("Inode size wrong: %d\n", (int)sizeof(struct inode));
+        return 1;
+    }
+
+    // Open input file
+    FILE *f = fopen(argv[optind], "rb");
+    if (f == NULL)
+    {
+        printf("Cannot open file\n");
+        return 1;
+    }
+    in_fd = fileno(f);
+
+    // Get file size
+    fseeko(f, 0, SEEK_END);
+    total_size = ftello(f);
+    fseeko(f, 0, SEEK_SET);
+
+    // Read superblock
+    if (total_size < BOOT_SIZE + SUPER_SIZE || fseeko(f, BOOT_SIZE, SEEK_SET) != 0 ||
+        fread(&super, sizeof(struct superblock), 1, f) != 1 || super.blocksize < 4)
+    {
+        printf("Read error\n");
+        return 1;
+    }
+    fseeko(f, 0, SEEK_SET);
+
+    // Pick block kernels
+    select_block_kernels();
+
+    // Calculate regions
+    inode_start = BOOT_SIZE + SUPER_SIZE + (long long)super.inode_offset * super.blocksize;
+    data_start = BOOT_SIZE + SUPER_SIZE + (long long)super.data_offset * super.blocksize;
+    swap_start = BOOT_SIZE + SUPER_SIZE + (long long)super.swap_offset * super.blocksize;
+
+    // Fix swap_start if needed
+    if (swap_start > total_size || swap_start < 0)
+    {
+        swap_start = total_size;
+    }
+
+    // Refuse to defragment an inconsistent image
+    if (check_first && preflight_check() < 0)
+    {
+        fclose(f);
+        return 1;
+    }
+
+    // Analysis and out-of-core runs only need the inode region for the index;
+    // defragmenting refreshes it but always takes data from the block trees
+    if (analyze_only || (index_path != NULL && 2 * total_size > mem_limit))
+    {
+        unsigned char *inodes = read_inode_region();
+        if (inodes == NULL)
+        {
+            printf("Read error\n");
+            return 1;
+        }
+        int rc = load_index(index_path, inodes);
+        free(inodes);
+        if (rc < 0)
+        {
+            printf("Index error\n");
+            return 1;
+        }
+    }
+
+    if (analyze_only)
+    {
+        print_analysis();
+        close_index();
+        fclose(f);
+        return 0;
+    }
+
+    // Input and output images must both fit in the budget, otherwise stream
+    if (2 * total_size > mem_limit)
+    {
+        int rc = defrag_out_of_core(mem_limit);
+        close_index();
+        fclose(f);
+        return rc;
+    }
+
+    // Allocate memory
+    input_disk = (unsigned char *)malloc(total_size);
+    output_disk = (unsigned char *)malloc(total_size);
+    if (input_disk == NULL || output_disk == NULL)
+    {
+        printf("Out of memory\n");
+        return 1;
+    }
+
+    // Read file
+    size_t bytes = fread(input_disk, 1, total_size, f);
+    if (bytes != (size_t)total_size)
+    {
+        printf("Read error\n");
+        return 1;
+    }
+    fclose(f);
+
+    // Refresh the index for later analysis runs
+    if (index_path != NULL && load_index(index_path, input_disk + inode_start) < 0)
+    {
+        printf("Index error\n");
+        return 1;
+    }
+
+    // Clear output
+    memset(output_disk, 0, total_size);
+
+    // Copy static regions
+    copy_static_regions();
+
+    // Process each inode
+    long long inode_size = data_start - inode_start;
+    long long total_inodes = inode_size / 100;
+    int next_block = 0;
+
+    long long inode_num;
+    for (inode_num = 0; inode_num < total_inodes; inode_num++)
+    {
+        struct inode *in_inode = (struct inode *)(input_disk + inode_start + inode_num * 100);
+        struct inode *out_inode = (struct inode *)(output_disk + inode_start + inode_num * 100);
+
+        if (in_inode->nlink == 0)
+            continue;
+
+        process_file(in_inode, out_inode, &next_block);
+    }
+
+    // Update superblock
+    struct superblock *out_sb = (struct superblock *)(output_disk + BOOT_SIZE);
+    out_sb->free_block = next_block;
+
+    // Create free block list
+    create_free_list(next_block);
+
+    // Write output file
+    FILE *out = fopen(OUTPUT_FILE_NAME, "wb");
+    if (out == NULL)
+    {
+        printf("Cannot create output file\n");
+        return 1;
+    }
+
+    size_t written = fwrite(output_disk, 1, total_size, out);
+    if (written != (size_t)total_size)
+    {
+        printf("Write error\n");
+        return 1;
+    }
+
+    fclose(out);
+    close_index();
+    free(input_disk);
+    free(output_disk);
+
+    return 0;
+}